@@ -2,6 +2,8 @@
 #ifndef MS912X_H
 #define MS912X_H
 
+#include <linux/iosys-map.h>
+#include <linux/ktime.h>
 #include <linux/mm_types.h>
 #include <linux/scatterlist.h>
 #include <linux/usb.h>
@@ -21,6 +23,79 @@
 
 #define MS912X_TOTAL_URBS 8
 
+/* Conversion of large rects is split into row bands that run on the
+ * shared conversion pool, one job per band.
+ */
+#define MS912X_CONVERT_JOBS 4
+#define MS912X_CONVERT_MIN_LINES 64
+#define MS912X_MAX_LINE_BYTES (2048 * 4)
+
+/* Lines converted at once when display lines are framebuffer columns */
+#define MS912X_ROTATE_BLOCK 16
+#define MS912X_TILE_BUFFER_BYTES (MS912X_MAX_LINE_BYTES * MS912X_ROTATE_BLOCK)
+
+/* Transfers time out after a few times the time they should take at the
+ * measured link rate, rates are in bytes per millisecond.
+ */
+#define MS912X_MIN_TIMEOUT_MS 50
+#define MS912X_TIMEOUT_FACTOR 4
+#define MS912X_USB2_RATE 30000
+#define MS912X_USB3_RATE 300000
+
+/* Damage is tracked in tiles, the width matches the horizontal
+ * granularity of the device.
+ */
+#define MS912X_TILE_WIDTH 16
+#define MS912X_TILE_HEIGHT 16
+#define MS912X_TILE_COLS (2048 / MS912X_TILE_WIDTH)
+#define MS912X_TILE_ROWS (2048 / MS912X_TILE_HEIGHT)
+#define MS912X_MAX_RECTS 16
+
+/* A full frame plus the rect headers and the terminator */
+#define MS912X_REQUEST_SIZE (2048 * 2048 * 2 + PAGE_SIZE)
+
+/* Scheduling of damage under bandwidth pressure. Tiles damaged in most
+ * recent frames are hot, large hot rects are bulk updates that are only
+ * sent while the link has bandwidth left after the other updates.
+ */
+#define MS912X_HEAT_STEP 16
+#define MS912X_HEAT_HOT 64
+#define MS912X_HEAT_PERIOD_MS 100
+#define MS912X_BULK_AREA (128 * 128)
+#define MS912X_BURST_MS 32
+#define MS912X_RESERVE_MS 4
+#define MS912X_RETRY_MS 5
+
+/* Bits of ms912x_device.recover_flags */
+#define MS912X_RECOVER_MODE 0
+#define MS912X_RECOVER_FULL 1
+
+/* How the framebuffer is shown on the display */
+struct ms912x_view {
+	/* Visible part of the framebuffer in pixels, before rotation */
+	struct drm_rect src;
+	unsigned int rotation;
+	unsigned int pitch;
+	/* Size on the display */
+	int width, height;
+};
+
+/* Identifies the frame that converted rects can be shared for between
+ * mirrored devices.
+ */
+struct ms912x_mirror_key {
+	const struct dma_buf *dmabuf;
+	/* Identifies the content, changes with every write fence */
+	u64 generation;
+	unsigned int offset;
+	struct ms912x_view view;
+};
+
+/* One bit per tile, one bitmap per row of tiles */
+struct ms912x_damage {
+	unsigned long bands[MS912X_TILE_ROWS][BITS_TO_LONGS(MS912X_TILE_COLS)];
+};
+
 struct ms912x_usb_request {
 	void *transfer_buffer;
 	struct ms912x_device *ms912x;
@@ -30,7 +105,40 @@ struct ms912x_usb_request {
 	struct usb_sg_request sgr;
 	struct work_struct work;
 	struct timer_list timer;
+
+	/* Completed once the transfer and every mirrored device copying
+	 * from transfer_buffer are done.
+	 */
 	struct completion done;
+	atomic_t users;
+
+	/* Rects in transfer_buffer and the offsets of their pixels, read
+	 * by mirrored devices while published.
+	 */
+	int nr_rects;
+	struct drm_rect rects[MS912X_MAX_RECTS];
+	size_t offsets[MS912X_MAX_RECTS];
+
+	/* Protected by the mirror lock */
+	bool published;
+	unsigned long published_at;
+	struct ms912x_mirror_key key;
+};
+
+struct ms912x_convert_job {
+	struct ms912x_device *ms912x;
+	struct work_struct work;
+	struct iosys_map src;
+	unsigned int pitch;
+	void *dst;
+	int width, lines;
+	/* Framebuffer pixel of the first pixel, and the steps in the
+	 * framebuffer to the next pixel and to the next line
+	 */
+	int sx, sy;
+	int col_dx, col_dy, row_dx, row_dy;
+	u32 *temp_buffer;
+	u32 *tile_buffer;
 };
 
 struct ms912x_device {
@@ -41,13 +149,79 @@ struct ms912x_device {
 	struct drm_connector connector;
 	struct drm_simple_display_pipe display_pipe;
 	
-	struct drm_rect update_rect;
+	/* Serializes frame updates and mode writes from commits and from
+	 * recovery, and protects mode and the source size.
+	 */
+	struct mutex update_lock;
+
+	/* The device double buffers, these are the tiles each of the
+	 * buffers misses, indexed like requests.
+	 */
+	struct ms912x_damage damage[2];
+	struct ms912x_damage scratch[2];
+
+	/* How often each tile has been damaged recently */
+	u8 heat[MS912X_TILE_ROWS][MS912X_TILE_COLS];
+	unsigned long heat_at;
+
+	/* Bytes the link can still take, refilled at link_rate */
+	s64 tokens;
+	ktime_t tokens_at;
+
+	/* Mode set by the last modeset, re-issued on recovery. The size of
+	 * the frames differs from the mode when the device scales.
+	 */
+	const struct ms912x_mode *mode;
+	int src_width, src_height;
+
+	/* Largest supported mode of the monitor, the output when scaling */
+	const struct ms912x_mode *native_mode;
+	/* Sends a hotplug event after the scaling mode changed */
+	struct work_struct reprobe_work;
+
+	unsigned int link_rate;
+	atomic_t transfer_errors;
+	unsigned long recover_flags;
+	/* Sends damage left over by throttling, failed sends and recovery */
+	struct delayed_work update_work;
 
 	/* Double buffer to allow memcpy and transfer 
 	 * to happen in parallel
 	 */
 	int current_request;
 	struct ms912x_usb_request requests[2];
+
+	/* Transfers of this device are submitted in order on their own
+	 * queue, its cpumask can be changed through workqueue sysfs.
+	 */
+	struct workqueue_struct *submit_wq;
+
+	struct ms912x_convert_job convert_jobs[MS912X_CONVERT_JOBS];
+	atomic_t convert_pending;
+	struct completion convert_done;
+
+	/* Bytes of buffers allocated by this device */
+	atomic_long_t mem_bytes;
+
+	struct list_head mirror_node;
+
+	/* Buffers are allocated while the device is reset after
+	 * registration, init_done completes when both have finished.
+	 */
+	struct work_struct alloc_work;
+	struct work_struct reset_work;
+	atomic_t init_pending;
+	struct completion init_done;
+	bool buffers_ready;
+	/* Buffers could not be allocated, the device stays disconnected */
+	bool init_failed;
+	/* EDID read during the reset, used by the first probe */
+	const struct drm_edid *edid;
+
+	/* Serializes control writes with the set and get report pair of
+	 * control reads.
+	 */
+	struct mutex ctrl_lock;
 };
 
 struct ms912x_request {
@@ -104,16 +278,76 @@ struct ms912x_mode {
 
 int ms912x_read_byte(struct ms912x_device *ms912x, u16 address);
 int ms912x_connector_init(struct ms912x_device *ms912x);
+void ms912x_connector_prefetch_edid(struct ms912x_device *ms912x);
 int ms912x_set_resolution(struct ms912x_device *ms912x,
-			  const struct ms912x_mode *mode);
+			  const struct ms912x_mode *mode, int src_width,
+			  int src_height);
+
+const struct ms912x_mode *
+ms912x_get_mode(const struct drm_display_mode *mode);
+const struct ms912x_mode *
+ms912x_get_native_mode(struct drm_connector *connector);
+int ms912x_add_scaled_modes(struct drm_connector *connector,
+			    const struct ms912x_mode *native);
 
 int ms912x_power_on(struct ms912x_device *ms912x);
 int ms912x_power_off(struct ms912x_device *ms912x);
 
-int ms912x_fb_send_rect(struct drm_framebuffer *fb, const struct iosys_map *map,
-			struct drm_rect *rect);
+void ms912x_get_view(const struct drm_plane_state *state,
+		     struct ms912x_view *view);
+void ms912x_fb_to_display(const struct ms912x_view *view,
+			  struct drm_rect *rect);
+int ms912x_fb_send_rects(const struct drm_plane_state *state,
+			 const struct iosys_map *map,
+			 const struct drm_rect *rects, int nr_rects);
+
+void ms912x_damage_add(struct ms912x_damage *damage,
+		       const struct drm_rect *rect);
+void ms912x_damage_clear(struct ms912x_damage *damage);
+int ms912x_damage_get_rects(const struct ms912x_damage *damage,
+			    const struct ms912x_damage *avoid,
+			    struct drm_rect *rects, int max, bool *dropped);
+void ms912x_damage_heat(struct ms912x_device *ms912x,
+			const struct drm_rect *rect);
+int ms912x_damage_schedule(struct ms912x_device *ms912x,
+			   const struct ms912x_damage *damage,
+			   struct drm_rect *rects, bool *deferred);
+void ms912x_damage_sent(struct ms912x_device *ms912x,
+			struct ms912x_damage *damage,
+			const struct drm_rect *rects, int nr_rects);
 
 void ms912x_free_request(struct ms912x_usb_request *request);
 int ms912x_init_request(struct ms912x_device *ms912x,
 			struct ms912x_usb_request *request, size_t len);
+void ms912x_request_put(struct ms912x_usb_request *request);
+void ms912x_cancel_request(struct ms912x_usb_request *request);
+
+void ms912x_mirror_add(struct ms912x_device *ms912x);
+void ms912x_mirror_remove(struct ms912x_device *ms912x);
+bool ms912x_mirror_make_key(struct drm_framebuffer *fb,
+			    const struct ms912x_view *view,
+			    struct ms912x_mirror_key *key);
+struct ms912x_usb_request *
+ms912x_mirror_get(struct ms912x_device *ms912x,
+		  const struct ms912x_mirror_key *key,
+		  const struct drm_rect *rect, int *index);
+void ms912x_mirror_publish(struct ms912x_usb_request *request,
+			   const struct ms912x_mirror_key *key);
+void ms912x_mirror_unpublish(struct ms912x_usb_request *request);
+
+int ms912x_init_convert_jobs(struct ms912x_device *ms912x);
+void ms912x_free_convert_jobs(struct ms912x_device *ms912x);
+
+int ms912x_convert_pool_init(void);
+void ms912x_convert_pool_fini(void);
+
+#ifdef CONFIG_DRM_FBDEV_EMULATION
+void ms912x_fbdev_setup(struct drm_device *dev, unsigned int preferred_bpp);
+#else
+static inline void ms912x_fbdev_setup(struct drm_device *dev,
+				      unsigned int preferred_bpp)
+{
+}
+#endif
+
 #endif
\ No newline at end of file
@@ -1,4 +1,5 @@
 
+#include <drm/drm_atomic.h>
 #include <drm/drm_atomic_state_helper.h>
 #include <drm/drm_connector.h>
 #include <drm/drm_edid.h>
@@ -26,8 +27,13 @@ static int ms912x_connector_get_modes(struct drm_connector *connector)
 {
 	int ret;
 	struct ms912x_device *ms912x = to_ms912x(connector->dev);
+	const struct ms912x_mode *native;
 	const struct drm_edid *edid;
-	edid = drm_edid_read_custom(connector, ms912x_read_edid, ms912x);
+
+	/* The EDID read while resetting the device is used once */
+	edid = xchg(&ms912x->edid, NULL);
+	if (!edid)
+		edid = drm_edid_read_custom(connector, ms912x_read_edid, ms912x);
 	if (!edid)
 		return 0;
 	ret = drm_edid_connector_update(connector, edid);
@@ -36,17 +42,51 @@ static int ms912x_connector_get_modes(struct drm_connector *connector)
 		goto edid_free;
 	}
 	ret = drm_edid_connector_add_modes(connector);
+
+	native = ms912x_get_native_mode(connector);
+	WRITE_ONCE(ms912x->native_mode, native);
+	if (native && connector->state->scaling_mode != DRM_MODE_SCALE_NONE)
+		ret += ms912x_add_scaled_modes(connector, native);
 edid_free:
 	drm_edid_free(edid);
 	return ret;
 }
 
+/* The output timing depends on the scaling mode, so changing it needs a
+ * modeset.
+ */
+static int ms912x_connector_atomic_check(struct drm_connector *connector,
+					 struct drm_atomic_state *state)
+{
+	struct drm_connector_state *old_state =
+		drm_atomic_get_old_connector_state(state, connector);
+	struct drm_connector_state *new_state =
+		drm_atomic_get_new_connector_state(state, connector);
+	struct drm_crtc_state *crtc_state;
+
+	if (!new_state->crtc ||
+	    old_state->scaling_mode == new_state->scaling_mode)
+		return 0;
+
+	crtc_state = drm_atomic_get_crtc_state(state, new_state->crtc);
+	if (IS_ERR(crtc_state))
+		return PTR_ERR(crtc_state);
+	crtc_state->mode_changed = true;
+	return 0;
+}
+
 static enum drm_connector_status ms912x_detect(struct drm_connector *connector,
 					       bool force)
 {
 	struct ms912x_device *ms912x = to_ms912x(connector->dev);
-	int status = ms912x_read_byte(ms912x, 0x32);
+	int status;
 
+	/* Reported once the device is reset, a hotplug event follows */
+	if (!completion_done(&ms912x->init_done) ||
+	    READ_ONCE(ms912x->init_failed))
+		return connector_status_disconnected;
+
+	status = ms912x_read_byte(ms912x, 0x32);
 	if (status < 0)
 		return connector_status_unknown;
 
@@ -55,6 +95,7 @@ static enum drm_connector_status ms912x_detect(struct drm_connector *connector,
 }
 static const struct drm_connector_helper_funcs ms912x_connector_helper_funcs = {
 	.get_modes = ms912x_connector_get_modes,
+	.atomic_check = ms912x_connector_atomic_check,
 };
 
 static const struct drm_connector_funcs ms912x_connector_funcs = {
@@ -66,6 +107,12 @@ static const struct drm_connector_funcs ms912x_connector_funcs = {
 	.atomic_destroy_state = drm_atomic_helper_connector_destroy_state,
 };
 
+void ms912x_connector_prefetch_edid(struct ms912x_device *ms912x)
+{
+	ms912x->edid = drm_edid_read_custom(&ms912x->connector,
+					    ms912x_read_edid, ms912x);
+}
+
 int ms912x_connector_init(struct ms912x_device *ms912x)
 {
 	int ret;
@@ -76,5 +123,11 @@ int ms912x_connector_init(struct ms912x_device *ms912x)
 				 DRM_MODE_CONNECTOR_HDMIA);
 	ms912x->connector.polled =
 		DRM_CONNECTOR_POLL_CONNECT | DRM_CONNECTOR_POLL_DISCONNECT;
-	return ret;
+	if (ret)
+		return ret;
+
+	/* Full screen lets the device scale smaller modes to the native mode */
+	return drm_connector_attach_scaling_mode_property(
+		&ms912x->connector,
+		BIT(DRM_MODE_SCALE_NONE) | BIT(DRM_MODE_SCALE_FULLSCREEN));
 }
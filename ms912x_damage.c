@@ -0,0 +1,304 @@
+
+#include <linux/bitmap.h>
+#include <linux/math64.h>
+#include <linux/module.h>
+
+#include <drm/drm_rect.h>
+
+#include "ms912x.h"
+
+/* Every rect costs a header in the transfer and a pass of conversion. When
+ * the damage needs more rects than this, the closest rects are merged.
+ * The limit applies to interactive and bulk damage separately.
+ */
+static unsigned int max_rects = 8;
+module_param(max_rects, uint, 0644);
+MODULE_PARM_DESC(max_rects,
+		 "Rects per class of damage in one transfer (1-8, default 8)");
+
+void ms912x_damage_add(struct ms912x_damage *damage,
+		       const struct drm_rect *rect)
+{
+	int x1 = max(rect->x1, 0) / MS912X_TILE_WIDTH;
+	int x2 = min(DIV_ROUND_UP(rect->x2, MS912X_TILE_WIDTH),
+		     MS912X_TILE_COLS);
+	int y1 = max(rect->y1, 0) / MS912X_TILE_HEIGHT;
+	int y2 = min(DIV_ROUND_UP(rect->y2, MS912X_TILE_HEIGHT),
+		     MS912X_TILE_ROWS);
+	int y;
+
+	if (x2 <= x1)
+		return;
+	for (y = y1; y < y2; y++)
+		bitmap_set(damage->bands[y], x1, x2 - x1);
+}
+
+void ms912x_damage_clear(struct ms912x_damage *damage)
+{
+	memset(damage, 0, sizeof(*damage));
+}
+
+static int ms912x_damage_area(const struct drm_rect *rect)
+{
+	return drm_rect_width(rect) * drm_rect_height(rect);
+}
+
+static bool ms912x_damage_covers(const struct ms912x_damage *damage,
+				 const struct drm_rect *rect)
+{
+	int x1 = rect->x1 / MS912X_TILE_WIDTH;
+	int x2 = rect->x2 / MS912X_TILE_WIDTH;
+	int y;
+
+	for (y = rect->y1 / MS912X_TILE_HEIGHT;
+	     y < rect->y2 / MS912X_TILE_HEIGHT; y++) {
+		if (find_next_bit(damage->bands[y], x2, x1) < x2)
+			return true;
+	}
+	return false;
+}
+
+/* Merges the two rects whose union adds the least area and does not
+ * cover a tile of avoid. Returns the new count, or -1 if no two rects can
+ * be merged.
+ */
+static int ms912x_damage_merge_closest(struct drm_rect *rects, int nr_rects,
+				       const struct ms912x_damage *avoid)
+{
+	int i, j, cost, best_i = -1, best_j = -1, best_cost = INT_MAX;
+	struct drm_rect merged;
+
+	for (i = 0; i < nr_rects; i++) {
+		for (j = i + 1; j < nr_rects; j++) {
+			merged.x1 = min(rects[i].x1, rects[j].x1);
+			merged.y1 = min(rects[i].y1, rects[j].y1);
+			merged.x2 = max(rects[i].x2, rects[j].x2);
+			merged.y2 = max(rects[i].y2, rects[j].y2);
+			cost = ms912x_damage_area(&merged) -
+			       ms912x_damage_area(&rects[i]) -
+			       ms912x_damage_area(&rects[j]);
+			if (cost >= best_cost ||
+			    (avoid && ms912x_damage_covers(avoid, &merged)))
+				continue;
+			best_cost = cost;
+			best_i = i;
+			best_j = j;
+		}
+	}
+
+	if (best_i < 0)
+		return -1;
+
+	rects[best_i].x1 = min(rects[best_i].x1, rects[best_j].x1);
+	rects[best_i].y1 = min(rects[best_i].y1, rects[best_j].y1);
+	rects[best_i].x2 = max(rects[best_i].x2, rects[best_j].x2);
+	rects[best_i].y2 = max(rects[best_i].y2, rects[best_j].y2);
+	rects[best_j] = rects[nr_rects - 1];
+	return nr_rects - 1;
+}
+
+/* Turns the damaged tiles into rects. Runs of tiles in a row of tiles
+ * become rects, which are extended downwards while the rows below have
+ * the same run. Past the limit, the closest rects are merged. Rects never
+ * grow over the tiles of avoid, runs that cannot be merged without that
+ * are left out and *dropped is set.
+ */
+int ms912x_damage_get_rects(const struct ms912x_damage *damage,
+			    const struct ms912x_damage *avoid,
+			    struct drm_rect *rects, int max, bool *dropped)
+{
+	int limit = min_t(int, clamp_t(int, max_rects, 1, MS912X_MAX_RECTS / 2),
+			  max);
+	struct drm_rect found[MS912X_MAX_RECTS + 1], rect;
+	int i, y, x1, x2, merged, nr_rects = 0;
+
+	*dropped = false;
+	for (y = 0; y < MS912X_TILE_ROWS; y++) {
+		x2 = 0;
+		for (;;) {
+			x1 = find_next_bit(damage->bands[y], MS912X_TILE_COLS,
+					   x2);
+			if (x1 >= MS912X_TILE_COLS)
+				break;
+			x2 = find_next_zero_bit(damage->bands[y],
+						MS912X_TILE_COLS, x1);
+
+			rect.x1 = x1 * MS912X_TILE_WIDTH;
+			rect.x2 = x2 * MS912X_TILE_WIDTH;
+			rect.y1 = y * MS912X_TILE_HEIGHT;
+			rect.y2 = rect.y1 + MS912X_TILE_HEIGHT;
+
+			for (i = 0; i < nr_rects; i++) {
+				if (found[i].x1 == rect.x1 &&
+				    found[i].x2 == rect.x2 &&
+				    found[i].y2 == rect.y1)
+					break;
+			}
+			if (i < nr_rects) {
+				found[i].y2 = rect.y2;
+				continue;
+			}
+			found[nr_rects++] = rect;
+			if (nr_rects <= limit)
+				continue;
+			merged = ms912x_damage_merge_closest(found, nr_rects,
+							     avoid);
+			if (merged < 0) {
+				nr_rects--;
+				*dropped = true;
+			} else {
+				nr_rects = merged;
+			}
+		}
+	}
+
+	memcpy(rects, found, nr_rects * sizeof(*rects));
+	return nr_rects;
+}
+
+static void ms912x_damage_clear_rect(struct ms912x_damage *damage,
+				     const struct drm_rect *rect)
+{
+	int x1 = rect->x1 / MS912X_TILE_WIDTH;
+	int x2 = rect->x2 / MS912X_TILE_WIDTH;
+	int y;
+
+	for (y = rect->y1 / MS912X_TILE_HEIGHT;
+	     y < rect->y2 / MS912X_TILE_HEIGHT; y++)
+		bitmap_clear(damage->bands[y], x1, x2 - x1);
+}
+
+static s64 ms912x_damage_bytes(const struct drm_rect *rect)
+{
+	return sizeof(struct ms912x_frame_update_header) +
+	       drm_rect_width(rect) * drm_rect_height(rect) * 2;
+}
+
+void ms912x_damage_heat(struct ms912x_device *ms912x,
+			const struct drm_rect *rect)
+{
+	int x1 = max(rect->x1, 0) / MS912X_TILE_WIDTH;
+	int x2 = min(DIV_ROUND_UP(rect->x2, MS912X_TILE_WIDTH),
+		     MS912X_TILE_COLS);
+	int y1 = max(rect->y1, 0) / MS912X_TILE_HEIGHT;
+	int y2 = min(DIV_ROUND_UP(rect->y2, MS912X_TILE_HEIGHT),
+		     MS912X_TILE_ROWS);
+	int x, y;
+
+	for (y = y1; y < y2; y++)
+		for (x = x1; x < x2; x++)
+			ms912x->heat[y][x] = min_t(int,
+						   ms912x->heat[y][x] +
+							   MS912X_HEAT_STEP,
+						   U8_MAX);
+}
+
+/* Halves the heat of all tiles once per period */
+static void ms912x_damage_cool(struct ms912x_device *ms912x)
+{
+	unsigned long periods = (jiffies - ms912x->heat_at) /
+				msecs_to_jiffies(MS912X_HEAT_PERIOD_MS);
+	u8 *heat = &ms912x->heat[0][0];
+	int i, shift;
+
+	if (!periods)
+		return;
+	shift = min(periods, 8UL);
+	for (i = 0; i < sizeof(ms912x->heat); i++)
+		heat[i] >>= shift;
+	ms912x->heat_at = jiffies;
+}
+
+static void ms912x_damage_refill(struct ms912x_device *ms912x)
+{
+	s64 rate = READ_ONCE(ms912x->link_rate);
+	ktime_t now = ktime_get();
+
+	ms912x->tokens += div_s64(rate * ktime_us_delta(now, ms912x->tokens_at),
+				  1000);
+	ms912x->tokens = min(ms912x->tokens, rate * MS912X_BURST_MS);
+	ms912x->tokens_at = now;
+}
+
+/* Picks the rects to send from what a device buffer misses. Interactive
+ * damage, small rects or tiles that are rarely updated, is always sent
+ * first. Large hot rects, like a playing video, are deferred while the
+ * link is saturated so they cannot delay the interactive updates.
+ */
+int ms912x_damage_schedule(struct ms912x_device *ms912x,
+			   const struct ms912x_damage *damage,
+			   struct drm_rect *rects, bool *deferred)
+{
+	struct ms912x_damage *cold = &ms912x->scratch[0];
+	struct ms912x_damage *hot = &ms912x->scratch[1];
+	struct drm_rect bulk[MS912X_MAX_RECTS];
+	s64 avail, reserve, budget, pitch;
+	int i, x, y, lines, nr_rects, nr_bulk;
+	bool dropped;
+
+	ms912x_damage_cool(ms912x);
+	ms912x_damage_refill(ms912x);
+
+	ms912x_damage_clear(cold);
+	ms912x_damage_clear(hot);
+	for (y = 0; y < MS912X_TILE_ROWS; y++) {
+		for_each_set_bit(x, damage->bands[y], MS912X_TILE_COLS) {
+			if (ms912x->heat[y][x] >= MS912X_HEAT_HOT)
+				__set_bit(x, hot->bands[y]);
+			else
+				__set_bit(x, cold->bands[y]);
+		}
+	}
+
+	/* Merged cold rects must not cover hot tiles, which would send them
+	 * past the budget, and merged hot rects must not send cold tiles
+	 * twice. What cannot be merged is sent next time.
+	 */
+	nr_rects = ms912x_damage_get_rects(cold, hot, rects,
+					   MS912X_MAX_RECTS / 2, &dropped);
+	*deferred = dropped;
+	nr_bulk = ms912x_damage_get_rects(hot, cold, bulk,
+					  MS912X_MAX_RECTS - nr_rects, &dropped);
+	*deferred |= dropped;
+
+	avail = ms912x->tokens;
+	for (i = 0; i < nr_rects; i++)
+		avail -= ms912x_damage_bytes(&rects[i]);
+
+	/* Large rects only get the bytes above the reserve. The tokens are
+	 * capped to a burst, so interactive updates wait behind at most a
+	 * burst of bulk. A rect that does not fit is sent in part, whole rows
+	 * of tiles from the top.
+	 */
+	reserve = (s64)READ_ONCE(ms912x->link_rate) * MS912X_RESERVE_MS;
+	for (i = 0; i < nr_bulk; i++) {
+		if (ms912x_damage_area(&bulk[i]) >= MS912X_BULK_AREA) {
+			pitch = drm_rect_width(&bulk[i]) * 2;
+			budget = avail - reserve -
+				 (s64)sizeof(struct ms912x_frame_update_header);
+			lines = budget > 0 ? div64_s64(budget, pitch) : 0;
+			lines = min(ALIGN_DOWN(lines, MS912X_TILE_HEIGHT),
+				    drm_rect_height(&bulk[i]));
+			if (lines < drm_rect_height(&bulk[i]))
+				*deferred = true;
+			if (!lines)
+				continue;
+			bulk[i].y2 = bulk[i].y1 + lines;
+		}
+		rects[nr_rects++] = bulk[i];
+		avail -= ms912x_damage_bytes(&bulk[i]);
+	}
+	return nr_rects;
+}
+
+void ms912x_damage_sent(struct ms912x_device *ms912x,
+			struct ms912x_damage *damage,
+			const struct drm_rect *rects, int nr_rects)
+{
+	int i;
+
+	for (i = 0; i < nr_rects; i++) {
+		ms912x_damage_clear_rect(damage, &rects[i]);
+		ms912x->tokens -= ms912x_damage_bytes(&rects[i]);
+	}
+}
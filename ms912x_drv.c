@@ -2,18 +2,25 @@
 
 #include <linux/module.h>
 
+#include <drm/drm_atomic.h>
 #include <drm/drm_atomic_helper.h>
+#include <drm/drm_blend.h>
 #include <drm/drm_crtc_helper.h>
 #include <drm/drm_damage_helper.h>
+#include <drm/drm_debugfs.h>
 #include <drm/drm_drv.h>
+#include <drm/drm_edid.h>
 #include <drm/drm_fb_helper.h>
-#include <drm/drm_fbdev_ttm.h>
 #include <drm/drm_file.h>
+#include <drm/drm_fourcc.h>
 #include <drm/drm_gem_atomic_helper.h>
 #include <drm/drm_gem_framebuffer_helper.h>
 #include <drm/drm_gem_shmem_helper.h>
 #include <drm/drm_managed.h>
 #include <drm/drm_ioctl.h>
+#include <drm/drm_modes.h>
+#include <drm/drm_modeset_helper_vtables.h>
+#include <drm/drm_modeset_lock.h>
 #include <drm/drm_probe_helper.h>
 #include <drm/drm_print.h>
 #include <drm/drm_simple_kms_helper.h>
@@ -51,6 +58,16 @@ ms912x_driver_gem_prime_import(struct drm_device *dev, struct dma_buf *dma_buf)
 	return drm_gem_prime_import_dev(dev, dma_buf, ms912x->dmadev);
 }
 
+static int ms912x_debugfs_mem_show(struct seq_file *m, void *data)
+{
+	struct drm_debugfs_entry *entry = m->private;
+	struct ms912x_device *ms912x = to_ms912x(entry->dev);
+
+	seq_printf(m, "allocated bytes: %ld\n",
+		   atomic_long_read(&ms912x->mem_bytes));
+	return 0;
+}
+
 DEFINE_DRM_GEM_FOPS(ms912x_driver_fops);
 
 static const struct drm_driver driver = {
@@ -75,6 +92,36 @@ static const struct drm_mode_config_funcs ms912x_mode_config_funcs = {
 	.atomic_commit = drm_atomic_helper_commit,
 };
 
+static void ms912x_reprobe_work(struct work_struct *work)
+{
+	struct ms912x_device *ms912x =
+		container_of(work, struct ms912x_device, reprobe_work);
+
+	drm_kms_helper_hotplug_event(&ms912x->drm);
+}
+
+/* The scaled modes are only listed while scaling is on, so clients have to
+ * probe the connector again when the scaling mode changes.
+ */
+static void ms912x_atomic_commit_tail(struct drm_atomic_state *state)
+{
+	struct drm_connector_state *old_state, *new_state;
+	struct drm_connector *connector;
+	int i;
+
+	drm_atomic_helper_commit_tail(state);
+
+	for_each_oldnew_connector_in_state(state, connector, old_state,
+					   new_state, i) {
+		if (old_state->scaling_mode != new_state->scaling_mode)
+			schedule_work(&to_ms912x(state->dev)->reprobe_work);
+	}
+}
+
+static const struct drm_mode_config_helper_funcs ms912x_mode_config_helpers = {
+	.atomic_commit_tail = ms912x_atomic_commit_tail,
+};
+
 static const struct ms912x_mode ms912x_mode_list[] = {
 	/* Found in captures of the Windows driver */
 	MS912X_MODE( 800,  600, 60, 0x4200, MS912X_PIXFMT_UYVY),
@@ -103,7 +150,7 @@ static const struct ms912x_mode ms912x_mode_list[] = {
 	/* TODO: more mode numbers? */
 };
 
-static const struct ms912x_mode *
+const struct ms912x_mode *
 ms912x_get_mode(const struct drm_display_mode *mode)
 {
 	int i;
@@ -120,25 +167,106 @@ ms912x_get_mode(const struct drm_display_mode *mode)
 	return ERR_PTR(-EINVAL);
 }
 
+/* Preferred mode of the monitor, or its largest mode the device supports */
+const struct ms912x_mode *
+ms912x_get_native_mode(struct drm_connector *connector)
+{
+	const struct ms912x_mode *native = NULL, *ms912x_mode;
+	struct drm_display_mode *mode;
+
+	list_for_each_entry(mode, &connector->probed_modes, head) {
+		ms912x_mode = ms912x_get_mode(mode);
+		if (IS_ERR(ms912x_mode))
+			continue;
+		if (mode->type & DRM_MODE_TYPE_PREFERRED)
+			return ms912x_mode;
+		if (!native || ms912x_mode->width * ms912x_mode->height >
+				       native->width * native->height)
+			native = ms912x_mode;
+	}
+	return native;
+}
+
+static bool ms912x_has_mode(struct drm_connector *connector,
+			    const struct ms912x_mode *ms912x_mode)
+{
+	struct drm_display_mode *mode;
+
+	list_for_each_entry(mode, &connector->probed_modes, head) {
+		if (mode->hdisplay == ms912x_mode->width &&
+		    mode->vdisplay == ms912x_mode->height &&
+		    drm_mode_vrefresh(mode) == ms912x_mode->hz)
+			return true;
+	}
+	return false;
+}
+
+/* Adds the smaller modes of the device that the monitor does not support,
+ * the device scales them to the native mode.
+ */
+int ms912x_add_scaled_modes(struct drm_connector *connector,
+			    const struct ms912x_mode *native)
+{
+	const struct ms912x_mode *ms912x_mode;
+	struct drm_display_mode *mode;
+	int i, count = 0;
+
+	for (i = 0; i < ARRAY_SIZE(ms912x_mode_list); i++) {
+		ms912x_mode = &ms912x_mode_list[i];
+		if (ms912x_mode->width > native->width ||
+		    ms912x_mode->height > native->height ||
+		    ms912x_has_mode(connector, ms912x_mode))
+			continue;
+		mode = drm_cvt_mode(connector->dev, ms912x_mode->width,
+				    ms912x_mode->height, ms912x_mode->hz, false,
+				    false, false);
+		if (!mode)
+			continue;
+		mode->type |= DRM_MODE_TYPE_DRIVER;
+		drm_mode_probed_add(connector, mode);
+		count++;
+	}
+	return count;
+}
+
 static void ms912x_pipe_enable(struct drm_simple_display_pipe *pipe,
 			       struct drm_crtc_state *crtc_state,
 			       struct drm_plane_state *plane_state)
 {
 	struct ms912x_device *ms912x = to_ms912x(pipe->crtc.dev);
 	struct drm_display_mode *mode = &crtc_state->mode;
+	const struct ms912x_mode *ms912x_mode = ms912x_get_mode(mode);
+	const struct ms912x_mode *native = READ_ONCE(ms912x->native_mode);
 
-	ms912x_power_on(ms912x);
+	/* Let the device scale the frames up to the native mode */
+	if (ms912x->connector.state->scaling_mode != DRM_MODE_SCALE_NONE &&
+	    native && native->width >= mode->hdisplay &&
+	    native->height >= mode->vdisplay)
+		ms912x_mode = native;
 
-	if (crtc_state->mode_changed) {
-		ms912x_set_resolution(ms912x, ms912x_get_mode(mode));
+	/* Do not race the reset of the device after probe */
+	wait_for_completion(&ms912x->init_done);
+
+	/* Recovery programs the mode too */
+	mutex_lock(&ms912x->update_lock);
+	ms912x_power_on(ms912x);
+	if (crtc_state->mode_changed && !IS_ERR(ms912x_mode)) {
+		ms912x_set_resolution(ms912x, ms912x_mode, mode->hdisplay,
+				      mode->vdisplay);
+		ms912x->mode = ms912x_mode;
+		ms912x->src_width = mode->hdisplay;
+		ms912x->src_height = mode->vdisplay;
 	}
+	mutex_unlock(&ms912x->update_lock);
 }
 
 static void ms912x_pipe_disable(struct drm_simple_display_pipe *pipe)
 {
 	struct ms912x_device *ms912x = to_ms912x(pipe->crtc.dev);
 
+	mutex_lock(&ms912x->update_lock);
 	ms912x_power_off(ms912x);
+	mutex_unlock(&ms912x->update_lock);
 }
 
 enum drm_mode_status
@@ -156,42 +284,130 @@ int ms912x_pipe_check(struct drm_simple_display_pipe *pipe,
 		      struct drm_plane_state *new_plane_state,
 		      struct drm_crtc_state *new_crtc_state)
 {
+	struct ms912x_device *ms912x = to_ms912x(pipe->crtc.dev);
+
+	/* Frames could never be sent */
+	if (READ_ONCE(ms912x->init_failed))
+		return -ENOMEM;
 	return 0;
 }
 
-static void ms912x_merge_rects(struct drm_rect *dest, struct drm_rect *r1,
-			       struct drm_rect *r2)
+/* Sends the damage the next device buffer misses, called with the
+ * update lock held.
+ */
+static void ms912x_flush_damage(struct ms912x_device *ms912x,
+				const struct drm_plane_state *state,
+				const struct iosys_map *map)
+{
+	struct ms912x_damage *damage = &ms912x->damage[ms912x->current_request];
+	struct drm_rect rects[MS912X_MAX_RECTS];
+	bool deferred;
+	int nr_rects, idx;
+
+	/* Damage is kept and sent in full once the buffers exist */
+	if (!smp_load_acquire(&ms912x->buffers_ready))
+		return;
+
+	nr_rects = ms912x_damage_schedule(ms912x, damage, rects, &deferred);
+	if (nr_rects) {
+		if (!ms912x_fb_send_rects(state, map, rects, nr_rects))
+			ms912x_damage_sent(ms912x, damage, rects, nr_rects);
+		else
+			deferred = true;
+	}
+
+	/* Send the rest once the link has caught up */
+	if (deferred && drm_dev_enter(&ms912x->drm, &idx)) {
+		schedule_delayed_work(&ms912x->update_work,
+				      msecs_to_jiffies(MS912X_RETRY_MS));
+		drm_dev_exit(idx);
+	}
+}
+
+static void ms912x_add_damage(struct ms912x_device *ms912x,
+			      const struct drm_rect *rect)
 {
-	dest->x1 = min(r1->x1, r2->x1);
-	dest->y1 = min(r1->y1, r2->y1);
-	dest->x2 = max(r1->x2, r2->x2);
-	dest->y2 = max(r1->y2, r2->y2);
+	/* The device double buffers, so both buffers miss the new damage */
+	ms912x_damage_add(&ms912x->damage[0], rect);
+	ms912x_damage_add(&ms912x->damage[1], rect);
 }
 
 static void ms912x_pipe_update(struct drm_simple_display_pipe *pipe,
 			       struct drm_plane_state *old_state)
 {
+	struct ms912x_device *ms912x = to_ms912x(pipe->crtc.dev);
 	struct drm_plane_state *state = pipe->plane.state;
 	struct drm_shadow_plane_state *shadow_plane_state =
 		to_drm_shadow_plane_state(state);
-	struct ms912x_device *ms912x;
-	struct drm_rect current_rect, rect;
-
-	if (drm_atomic_helper_damage_merged(old_state, state, &current_rect)) {
-		/* The device double buffers, so we need to send the update
-		 * rects of the last two frames.
-		 */
-		ms912x = to_ms912x(state->fb->dev);
-		ms912x_merge_rects(&rect, &current_rect, &ms912x->update_rect);
-		if (ms912x_fb_send_rect(state->fb, &shadow_plane_state->data[0],
-					&rect)) {
-			/* In case of error, merge the rects to update later */
-			ms912x_merge_rects(&ms912x->update_rect,
-					   &ms912x->update_rect, &rect);
-		} else {
-			ms912x->update_rect = current_rect;
-		}
+	struct drm_atomic_helper_damage_iter iter;
+	struct ms912x_view view;
+	struct drm_rect clip;
+	bool damaged = false;
+
+	mutex_lock(&ms912x->update_lock);
+	/* Clips are tracked separately so that a small update is not
+	 * merged with a large one.
+	 */
+	drm_atomic_helper_damage_iter_init(&iter, old_state, state);
+	drm_atomic_for_each_plane_damage(&iter, &clip) {
+		if (!damaged)
+			ms912x_get_view(state, &view);
+		ms912x_fb_to_display(&view, &clip);
+		ms912x_add_damage(ms912x, &clip);
+		ms912x_damage_heat(ms912x, &clip);
+		damaged = true;
 	}
+	if (damaged)
+		ms912x_flush_damage(ms912x, state, &shadow_plane_state->data[0]);
+	mutex_unlock(&ms912x->update_lock);
+}
+
+/* Sends damage that could not be sent during a commit, and the full frame
+ * after a failed transfer. The shadow plane mapping only exists during a
+ * commit, so the framebuffer is mapped here.
+ */
+static void ms912x_update_work(struct work_struct *work)
+{
+	struct ms912x_device *ms912x =
+		container_of(to_delayed_work(work), struct ms912x_device,
+			     update_work);
+	struct drm_plane *plane = &ms912x->display_pipe.plane;
+	struct iosys_map map[DRM_FORMAT_MAX_PLANES];
+	struct iosys_map data[DRM_FORMAT_MAX_PLANES];
+	struct drm_framebuffer *fb;
+	struct drm_rect rect;
+	int idx;
+
+	if (!drm_dev_enter(&ms912x->drm, &idx))
+		return;
+
+	drm_modeset_lock(&plane->mutex, NULL);
+	fb = plane->state->fb;
+	if (!fb || !plane->state->visible)
+		goto unlock;
+
+	mutex_lock(&ms912x->update_lock);
+	if (test_and_clear_bit(MS912X_RECOVER_MODE, &ms912x->recover_flags) &&
+	    ms912x->mode) {
+		ms912x_power_on(ms912x);
+		ms912x_set_resolution(ms912x, ms912x->mode, ms912x->src_width,
+				      ms912x->src_height);
+	}
+
+	if (drm_gem_fb_vmap(fb, map, data))
+		goto unlock_update;
+	if (test_and_clear_bit(MS912X_RECOVER_FULL, &ms912x->recover_flags)) {
+		drm_rect_init(&rect, 0, 0, drm_rect_width(&plane->state->dst),
+			      drm_rect_height(&plane->state->dst));
+		ms912x_add_damage(ms912x, &rect);
+	}
+	ms912x_flush_damage(ms912x, plane->state, &data[0]);
+	drm_gem_fb_vunmap(fb, map);
+unlock_update:
+	mutex_unlock(&ms912x->update_lock);
+unlock:
+	drm_modeset_unlock(&plane->mutex);
+	drm_dev_exit(idx);
 }
 
 static const struct drm_simple_display_pipe_funcs ms912x_pipe_funcs = {
@@ -207,12 +423,88 @@ static const uint32_t ms912x_pipe_formats[] = {
 	DRM_FORMAT_XRGB8888,
 };
 
+/* The first probe of the connector waits for this, so the hotplug event
+ * tells clients to probe again.
+ */
+static void ms912x_init_finish(struct ms912x_device *ms912x)
+{
+	if (!atomic_dec_and_test(&ms912x->init_pending))
+		return;
+	complete_all(&ms912x->init_done);
+
+	/* Send what was shown while the device was initialized */
+	if (ms912x->buffers_ready) {
+		set_bit(MS912X_RECOVER_FULL, &ms912x->recover_flags);
+		schedule_delayed_work(&ms912x->update_work, 0);
+	}
+	drm_kms_helper_hotplug_event(&ms912x->drm);
+}
+
+static int ms912x_alloc_buffers(struct ms912x_device *ms912x)
+{
+	int ret;
+
+	ret = ms912x_init_convert_jobs(ms912x);
+	if (ret)
+		return ret;
+
+	ret = ms912x_init_request(ms912x, &ms912x->requests[0],
+				  MS912X_REQUEST_SIZE);
+	if (ret)
+		goto err_free_convert_jobs;
+
+	ret = ms912x_init_request(ms912x, &ms912x->requests[1],
+				  MS912X_REQUEST_SIZE);
+	if (ret)
+		goto err_free_request_0;
+
+	return 0;
+
+err_free_request_0:
+	ms912x_free_request(&ms912x->requests[0]);
+err_free_convert_jobs:
+	ms912x_free_convert_jobs(ms912x);
+	return ret;
+}
+
+static void ms912x_alloc_work(struct work_struct *work)
+{
+	struct ms912x_device *ms912x =
+		container_of(work, struct ms912x_device, alloc_work);
+	int ret;
+
+	ret = ms912x_alloc_buffers(ms912x);
+	if (ret) {
+		drm_err(&ms912x->drm, "failed to allocate buffers: %d\n", ret);
+		WRITE_ONCE(ms912x->init_failed, true);
+	} else {
+		smp_store_release(&ms912x->buffers_ready, true);
+		ms912x_mirror_add(ms912x);
+	}
+	ms912x_init_finish(ms912x);
+}
+
+static void ms912x_reset_work(struct work_struct *work)
+{
+	struct ms912x_device *ms912x =
+		container_of(work, struct ms912x_device, reset_work);
+
+	/* This stops weird behavior in the device */
+	ms912x_set_resolution(ms912x, &ms912x_mode_list[0],
+			      ms912x_mode_list[0].width,
+			      ms912x_mode_list[0].height);
+
+	ms912x_connector_prefetch_edid(ms912x);
+	ms912x_init_finish(ms912x);
+}
+
 static int ms912x_usb_probe(struct usb_interface *interface,
 			    const struct usb_device_id *id)
 {
 	int ret;
 	struct ms912x_device *ms912x;
 	struct drm_device *dev;
+	struct usb_device *usbdev = interface_to_usbdev(interface);
 
 	ms912x = devm_drm_dev_alloc(&interface->dev, &driver,
 				    struct ms912x_device, drm);
@@ -222,6 +514,22 @@ static int ms912x_usb_probe(struct usb_interface *interface,
 	ms912x->intf = interface;
 	dev = &ms912x->drm;
 
+	mutex_init(&ms912x->ctrl_lock);
+	mutex_init(&ms912x->update_lock);
+	INIT_DELAYED_WORK(&ms912x->update_work, ms912x_update_work);
+	INIT_WORK(&ms912x->reprobe_work, ms912x_reprobe_work);
+	ms912x->link_rate = usbdev->speed >= USB_SPEED_SUPER ?
+				    MS912X_USB3_RATE :
+				    MS912X_USB2_RATE;
+
+	/* Allocating buffers and resetting the device, which includes
+	 * reading the EDID, run in parallel after registration.
+	 */
+	INIT_WORK(&ms912x->alloc_work, ms912x_alloc_work);
+	INIT_WORK(&ms912x->reset_work, ms912x_reset_work);
+	init_completion(&ms912x->init_done);
+	atomic_set(&ms912x->init_pending, 2);
+
 	ms912x->dmadev = usb_intf_get_dma_device(interface);
 	if (!ms912x->dmadev)
 		drm_warn(dev,
@@ -236,24 +544,19 @@ static int ms912x_usb_probe(struct usb_interface *interface,
 	dev->mode_config.min_height = 0;
 	dev->mode_config.max_height = 2048;
 	dev->mode_config.funcs = &ms912x_mode_config_funcs;
+	dev->mode_config.helper_private = &ms912x_mode_config_helpers;
 
-	/* This stops weird behavior in the device */
-	ms912x_set_resolution(ms912x, &ms912x_mode_list[0]);
-
-	ret = ms912x_init_request(ms912x, &ms912x->requests[0],
-				  2048 * 2048 * 2);
-	if (ret)
+	ms912x->submit_wq = alloc_workqueue("ms912x-%d-%d",
+					    WQ_UNBOUND | WQ_SYSFS, 1,
+					    usbdev->bus->busnum, usbdev->devnum);
+	if (!ms912x->submit_wq) {
+		ret = -ENOMEM;
 		goto err_put_device;
-
-	ret = ms912x_init_request(ms912x, &ms912x->requests[1],
-				  2048 * 2048 * 2);
-	if (ret)
-		goto err_free_request_0;
-	complete(&ms912x->requests[1].done);
+	}
 
 	ret = ms912x_connector_init(ms912x);
 	if (ret)
-		goto err_free_request_1;
+		goto err_destroy_wq;
 
 	ret = drm_simple_display_pipe_init(&ms912x->drm, &ms912x->display_pipe,
 					   &ms912x_pipe_funcs,
@@ -261,28 +564,40 @@ static int ms912x_usb_probe(struct usb_interface *interface,
 					   ARRAY_SIZE(ms912x_pipe_formats),
 					   NULL, &ms912x->connector);
 	if (ret)
-		goto err_free_request_1;
+		goto err_destroy_wq;
 
 	drm_plane_enable_fb_damage_clips(&ms912x->display_pipe.plane);
 
+	/* Rotation is applied during conversion */
+	ret = drm_plane_create_rotation_property(
+		&ms912x->display_pipe.plane, DRM_MODE_ROTATE_0,
+		DRM_MODE_ROTATE_0 | DRM_MODE_ROTATE_90 | DRM_MODE_ROTATE_180 |
+			DRM_MODE_ROTATE_270 | DRM_MODE_REFLECT_X |
+			DRM_MODE_REFLECT_Y);
+	if (ret)
+		goto err_destroy_wq;
+
 	drm_mode_config_reset(dev);
 
 	usb_set_intfdata(interface, ms912x);
 
 	drm_kms_helper_poll_init(dev);
 
+	drm_debugfs_add_file(dev, "ms912x_mem", ms912x_debugfs_mem_show, NULL);
+
 	ret = drm_dev_register(dev, 0);
 	if (ret)
-		goto err_free_request_1;
+		goto err_destroy_wq;
 
-	drm_fbdev_ttm_setup(dev, 0);
+	queue_work(system_unbound_wq, &ms912x->alloc_work);
+	queue_work(system_unbound_wq, &ms912x->reset_work);
+
+	ms912x_fbdev_setup(dev, 0);
 
 	return 0;
 
-err_free_request_1:
-	ms912x_free_request(&ms912x->requests[1]);
-err_free_request_0:
-	ms912x_free_request(&ms912x->requests[0]);
+err_destroy_wq:
+	destroy_workqueue(ms912x->submit_wq);
 err_put_device:
 	put_device(ms912x->dmadev);
 	return ret;
@@ -293,13 +608,30 @@ static void ms912x_usb_disconnect(struct usb_interface *interface)
 	struct ms912x_device *ms912x = usb_get_intfdata(interface);
 	struct drm_device *dev = &ms912x->drm;
 
-	cancel_work_sync(&ms912x->requests[0].work);
-	cancel_work_sync(&ms912x->requests[1].work);
+	flush_work(&ms912x->alloc_work);
+	flush_work(&ms912x->reset_work);
 	drm_kms_helper_poll_fini(dev);
+	/* Nothing queues transfers or re-arms the update work after this */
 	drm_dev_unplug(dev);
 	drm_atomic_helper_shutdown(dev);
-	ms912x_free_request(&ms912x->requests[0]);
-	ms912x_free_request(&ms912x->requests[1]);
+	cancel_work_sync(&ms912x->reprobe_work);
+	if (ms912x->buffers_ready) {
+		ms912x_mirror_remove(ms912x);
+		ms912x_cancel_request(&ms912x->requests[0]);
+		ms912x_cancel_request(&ms912x->requests[1]);
+	}
+	destroy_workqueue(ms912x->submit_wq);
+	if (ms912x->buffers_ready) {
+		/* Wait for mirrored devices still copying from our buffers */
+		wait_for_completion(&ms912x->requests[0].done);
+		wait_for_completion(&ms912x->requests[1].done);
+		ms912x_free_request(&ms912x->requests[0]);
+		ms912x_free_request(&ms912x->requests[1]);
+		ms912x_free_convert_jobs(ms912x);
+	}
+	disable_delayed_work_sync(&ms912x->update_work);
+	drm_edid_free(ms912x->edid);
+	ms912x->edid = NULL;
 	put_device(ms912x->dmadev);
 	ms912x->dmadev = NULL;
 }
@@ -323,5 +655,27 @@ static struct usb_driver ms912x_driver = {
 	.resume = ms912x_usb_resume,
 	.id_table = id_table,
 };
-module_usb_driver(ms912x_driver);
+
+static int __init ms912x_init(void)
+{
+	int ret;
+
+	ret = ms912x_convert_pool_init();
+	if (ret)
+		return ret;
+
+	ret = usb_register(&ms912x_driver);
+	if (ret)
+		ms912x_convert_pool_fini();
+	return ret;
+}
+
+static void __exit ms912x_exit(void)
+{
+	usb_deregister(&ms912x_driver);
+	ms912x_convert_pool_fini();
+}
+
+module_init(ms912x_init);
+module_exit(ms912x_exit);
 MODULE_LICENSE("GPL");
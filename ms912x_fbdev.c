@@ -0,0 +1,324 @@
+
+#include <linux/fb.h>
+#include <linux/module.h>
+
+#include <drm/drm_client.h>
+#include <drm/drm_drv.h>
+#include <drm/drm_fb_helper.h>
+#include <drm/drm_framebuffer.h>
+#include <drm/drm_gem_framebuffer_helper.h>
+#include <drm/drm_gem_shmem_helper.h>
+#include <drm/drm_print.h>
+
+#include "ms912x.h"
+
+/* Based on the shmem fbdev emulation. The difference is the deferred I/O
+ * callback: the core helper merges all pages written during a period into
+ * one range, which turns writes at the top and the bottom of the screen
+ * into a full frame.
+ */
+
+static int ms912x_fbdev_fb_open(struct fb_info *info, int user)
+{
+	struct drm_fb_helper *fb_helper = info->par;
+
+	/* fbcon unbinds on unregister, only user space needs a reference */
+	if (user && !try_module_get(fb_helper->dev->driver->fops->owner))
+		return -ENODEV;
+
+	return 0;
+}
+
+static int ms912x_fbdev_fb_release(struct fb_info *info, int user)
+{
+	struct drm_fb_helper *fb_helper = info->par;
+
+	if (user)
+		module_put(fb_helper->dev->driver->fops->owner);
+
+	return 0;
+}
+
+FB_GEN_DEFAULT_DEFERRED_SYSMEM_OPS(ms912x_fbdev, drm_fb_helper_damage_range,
+				   drm_fb_helper_damage_area);
+
+static int ms912x_fbdev_fb_mmap(struct fb_info *info,
+				struct vm_area_struct *vma)
+{
+	struct drm_fb_helper *fb_helper = info->par;
+	struct drm_gem_object *obj = drm_gem_fb_get_obj(fb_helper->fb, 0);
+	struct drm_gem_shmem_object *shmem = to_drm_gem_shmem_obj(obj);
+
+	if (shmem->map_wc)
+		vma->vm_page_prot = pgprot_writecombine(vma->vm_page_prot);
+
+	return fb_deferred_io_mmap(info, vma);
+}
+
+static void ms912x_fbdev_fb_destroy(struct fb_info *info)
+{
+	struct drm_fb_helper *fb_helper = info->par;
+
+	if (!fb_helper->dev)
+		return;
+
+	fb_deferred_io_cleanup(info);
+	drm_fb_helper_fini(fb_helper);
+
+	drm_client_buffer_vunmap(fb_helper->buffer);
+	drm_client_framebuffer_delete(fb_helper->buffer);
+	drm_client_release(&fb_helper->client);
+	drm_fb_helper_unprepare(fb_helper);
+	kfree(fb_helper);
+}
+
+static const struct fb_ops ms912x_fbdev_fb_ops = {
+	.owner = THIS_MODULE,
+	.fb_open = ms912x_fbdev_fb_open,
+	.fb_release = ms912x_fbdev_fb_release,
+	__FB_DEFAULT_DEFERRED_OPS_RDWR(ms912x_fbdev),
+	DRM_FB_HELPER_DEFAULT_OPS,
+	__FB_DEFAULT_DEFERRED_OPS_DRAW(ms912x_fbdev),
+	.fb_mmap = ms912x_fbdev_fb_mmap,
+	.fb_destroy = ms912x_fbdev_fb_destroy,
+};
+
+static struct page *ms912x_fbdev_get_page(struct fb_info *info,
+					  unsigned long offset)
+{
+	struct drm_fb_helper *fb_helper = info->par;
+	struct drm_gem_object *obj = drm_gem_fb_get_obj(fb_helper->fb, 0);
+	struct drm_gem_shmem_object *shmem = to_drm_gem_shmem_obj(obj);
+	struct page *page;
+
+	if (fb_WARN_ON_ONCE(info, offset >= obj->size))
+		return NULL;
+
+	/* The pages stay pinned by the vmap of the client buffer */
+	page = shmem->pages[offset >> PAGE_SHIFT];
+	if (page)
+		get_page(page);
+	fb_WARN_ON_ONCE(info, !page);
+
+	return page;
+}
+
+/* Turns every run of written pages into its own range of lines. Runs that
+ * share a line are merged, and once the clips run out the last one is
+ * extended.
+ */
+static void ms912x_fbdev_deferred_io(struct fb_info *info,
+				     struct list_head *pagereflist)
+{
+	struct drm_fb_helper *fb_helper = info->par;
+	struct drm_framebuffer *fb = fb_helper->fb;
+	struct drm_clip_rect clips[MS912X_MAX_RECTS];
+	struct fb_deferred_io_pageref *pageref;
+	unsigned int pitch = fb->pitches[0];
+	unsigned int y1, y2;
+	int nr_clips = 0;
+	int ret;
+
+	list_for_each_entry(pageref, pagereflist, list) {
+		y1 = pageref->offset / pitch;
+		y2 = min_t(unsigned int,
+			   DIV_ROUND_UP(pageref->offset + PAGE_SIZE, pitch),
+			   fb->height);
+		if (y1 >= y2)
+			continue;
+
+		if (nr_clips && (y1 <= clips[nr_clips - 1].y2 ||
+				 nr_clips == ARRAY_SIZE(clips))) {
+			clips[nr_clips - 1].y2 =
+				max_t(unsigned int, clips[nr_clips - 1].y2, y2);
+			continue;
+		}
+		clips[nr_clips].x1 = 0;
+		clips[nr_clips].y1 = y1;
+		clips[nr_clips].x2 = fb->width;
+		clips[nr_clips].y2 = y2;
+		nr_clips++;
+	}
+
+	if (!nr_clips || !fb->funcs->dirty)
+		return;
+
+	ret = fb->funcs->dirty(fb, NULL, 0, 0, clips, nr_clips);
+	drm_WARN_ONCE(fb->dev, ret, "dirty failed: %d\n", ret);
+}
+
+static int ms912x_fbdev_fb_probe(struct drm_fb_helper *fb_helper,
+				 struct drm_fb_helper_surface_size *sizes)
+{
+	struct drm_client_dev *client = &fb_helper->client;
+	struct drm_device *dev = fb_helper->dev;
+	struct drm_client_buffer *buffer;
+	struct drm_gem_shmem_object *shmem;
+	struct drm_framebuffer *fb;
+	struct fb_info *info;
+	struct iosys_map map;
+	u32 format;
+	int ret;
+
+	format = drm_driver_legacy_fb_format(dev, sizes->surface_bpp,
+					     sizes->surface_depth);
+	buffer = drm_client_framebuffer_create(client, sizes->surface_width,
+					       sizes->surface_height, format);
+	if (IS_ERR(buffer))
+		return PTR_ERR(buffer);
+	shmem = to_drm_gem_shmem_obj(buffer->gem);
+	fb = buffer->fb;
+
+	ret = drm_client_buffer_vmap(buffer, &map);
+	if (ret)
+		goto err_delete_buffer;
+	if (drm_WARN_ON(dev, map.is_iomem)) {
+		ret = -ENODEV;
+		goto err_vunmap_buffer;
+	}
+
+	fb_helper->buffer = buffer;
+	fb_helper->fb = fb;
+
+	info = drm_fb_helper_alloc_info(fb_helper);
+	if (IS_ERR(info)) {
+		ret = PTR_ERR(info);
+		goto err_clear_helper;
+	}
+
+	drm_fb_helper_fill_info(info, fb_helper, sizes);
+
+	info->fbops = &ms912x_fbdev_fb_ops;
+	info->flags |= FBINFO_VIRTFB;
+	if (!shmem->map_wc)
+		info->flags |= FBINFO_READS_FAST;
+	info->screen_size = sizes->surface_height * fb->pitches[0];
+	info->screen_buffer = map.vaddr;
+	info->fix.smem_len = info->screen_size;
+
+	/* Sorted so that runs of pages are adjacent in the list */
+	fb_helper->fbdefio.delay = HZ / 20;
+	fb_helper->fbdefio.sort_pagereflist = true;
+	fb_helper->fbdefio.get_page = ms912x_fbdev_get_page;
+	fb_helper->fbdefio.deferred_io = ms912x_fbdev_deferred_io;
+
+	info->fbdefio = &fb_helper->fbdefio;
+	ret = fb_deferred_io_init(info);
+	if (ret)
+		goto err_release_info;
+
+	return 0;
+
+err_release_info:
+	drm_fb_helper_release_info(fb_helper);
+err_clear_helper:
+	fb_helper->fb = NULL;
+	fb_helper->buffer = NULL;
+err_vunmap_buffer:
+	drm_client_buffer_vunmap(buffer);
+err_delete_buffer:
+	drm_client_framebuffer_delete(buffer);
+	return ret;
+}
+
+/* Console drawing, reported as the exact area that was drawn */
+static int ms912x_fbdev_fb_dirty(struct drm_fb_helper *fb_helper,
+				 struct drm_clip_rect *clip)
+{
+	struct drm_framebuffer *fb = fb_helper->fb;
+	int ret;
+
+	if (!(clip->x1 < clip->x2 && clip->y1 < clip->y2))
+		return 0;
+	if (!fb->funcs->dirty)
+		return 0;
+
+	ret = fb->funcs->dirty(fb, NULL, 0, 0, clip, 1);
+	if (drm_WARN_ONCE(fb->dev, ret, "dirty failed: %d\n", ret))
+		return ret;
+	return 0;
+}
+
+static const struct drm_fb_helper_funcs ms912x_fbdev_helper_funcs = {
+	.fb_probe = ms912x_fbdev_fb_probe,
+	.fb_dirty = ms912x_fbdev_fb_dirty,
+};
+
+static void ms912x_fbdev_client_unregister(struct drm_client_dev *client)
+{
+	struct drm_fb_helper *fb_helper = drm_fb_helper_from_client(client);
+
+	if (fb_helper->info) {
+		drm_fb_helper_unregister_info(fb_helper);
+	} else {
+		drm_client_release(&fb_helper->client);
+		drm_fb_helper_unprepare(fb_helper);
+		kfree(fb_helper);
+	}
+}
+
+static int ms912x_fbdev_client_restore(struct drm_client_dev *client)
+{
+	drm_fb_helper_lastclose(client->dev);
+
+	return 0;
+}
+
+static int ms912x_fbdev_client_hotplug(struct drm_client_dev *client)
+{
+	struct drm_fb_helper *fb_helper = drm_fb_helper_from_client(client);
+	struct drm_device *dev = client->dev;
+	int ret;
+
+	if (dev->fb_helper)
+		return drm_fb_helper_hotplug_event(dev->fb_helper);
+
+	ret = drm_fb_helper_init(dev, fb_helper);
+	if (ret)
+		goto err_drm_err;
+
+	ret = drm_fb_helper_initial_config(fb_helper);
+	if (ret)
+		goto err_fb_helper_fini;
+
+	return 0;
+
+err_fb_helper_fini:
+	drm_fb_helper_fini(fb_helper);
+err_drm_err:
+	drm_err(dev, "failed to set up fbdev emulation: %d\n", ret);
+	return ret;
+}
+
+static const struct drm_client_funcs ms912x_fbdev_client_funcs = {
+	.owner = THIS_MODULE,
+	.unregister = ms912x_fbdev_client_unregister,
+	.restore = ms912x_fbdev_client_restore,
+	.hotplug = ms912x_fbdev_client_hotplug,
+};
+
+void ms912x_fbdev_setup(struct drm_device *dev, unsigned int preferred_bpp)
+{
+	struct drm_fb_helper *fb_helper;
+	int ret;
+
+	fb_helper = kzalloc(sizeof(*fb_helper), GFP_KERNEL);
+	if (!fb_helper)
+		return;
+	drm_fb_helper_prepare(dev, fb_helper, preferred_bpp,
+			      &ms912x_fbdev_helper_funcs);
+
+	ret = drm_client_init(dev, &fb_helper->client, "fbdev",
+			      &ms912x_fbdev_client_funcs);
+	if (ret) {
+		drm_err(dev, "failed to register fbdev client: %d\n", ret);
+		goto err_unprepare;
+	}
+
+	drm_client_register(&fb_helper->client);
+	return;
+
+err_unprepare:
+	drm_fb_helper_unprepare(fb_helper);
+	kfree(fb_helper);
+}
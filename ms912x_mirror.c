@@ -0,0 +1,164 @@
+
+#include <linux/dma-buf.h>
+#include <linux/dma-resv.h>
+#include <linux/hash.h>
+#include <linux/module.h>
+
+#include <drm/drm_gem.h>
+
+#include "ms912x.h"
+
+/* Devices that show the same dma-buf, for example the outputs of a video
+ * wall, convert a rect only once. Every device publishes the rects in its
+ * transfer buffer, and the others copy the pixels of a rect that lies
+ * within one of them while the content of the dma-buf has not changed,
+ * which the write fences tell. Devices schedule their damage on their
+ * own, so rects are matched one by one. The window bounds how long a
+ * payload is offered.
+ */
+static unsigned int mirror_window_ms = 10;
+module_param(mirror_window_ms, uint, 0644);
+MODULE_PARM_DESC(mirror_window_ms,
+		 "Time converted rects are shared with mirrored devices (0 = off)");
+
+static LIST_HEAD(ms912x_mirror_list);
+static DEFINE_MUTEX(ms912x_mirror_lock);
+
+void ms912x_mirror_add(struct ms912x_device *ms912x)
+{
+	mutex_lock(&ms912x_mirror_lock);
+	list_add_tail(&ms912x->mirror_node, &ms912x_mirror_list);
+	mutex_unlock(&ms912x_mirror_lock);
+}
+
+void ms912x_mirror_remove(struct ms912x_device *ms912x)
+{
+	mutex_lock(&ms912x_mirror_lock);
+	ms912x->requests[0].published = false;
+	ms912x->requests[1].published = false;
+	list_del(&ms912x->mirror_node);
+	mutex_unlock(&ms912x_mirror_lock);
+}
+
+/* Combines the write fences of the buffer. A buffer without them can
+ * be redrawn by the CPU at any time and is never shared.
+ */
+static bool ms912x_mirror_generation(struct dma_resv *resv, u64 *generation)
+{
+	struct dma_resv_iter cursor;
+	struct dma_fence *fence;
+	bool found = false;
+	u64 gen = 0;
+
+	dma_resv_iter_begin(&cursor, resv, DMA_RESV_USAGE_WRITE);
+	dma_resv_for_each_fence_unlocked(&cursor, fence) {
+		if (dma_resv_iter_is_restarted(&cursor)) {
+			gen = 0;
+			found = false;
+		}
+		gen = hash_64(gen ^ fence->context, 64) ^ fence->seqno;
+		found = true;
+	}
+	dma_resv_iter_end(&cursor);
+
+	*generation = gen;
+	return found;
+}
+
+bool ms912x_mirror_make_key(struct drm_framebuffer *fb,
+			    const struct ms912x_view *view,
+			    struct ms912x_mirror_key *key)
+{
+	struct drm_gem_object *obj = fb->obj[0];
+	struct dma_buf *dmabuf;
+
+	if (!mirror_window_ms)
+		return false;
+
+	dmabuf = obj->import_attach ? obj->import_attach->dmabuf : obj->dma_buf;
+	if (!dmabuf)
+		return false;
+
+	memset(key, 0, sizeof(*key));
+	if (!ms912x_mirror_generation(dmabuf->resv, &key->generation))
+		return false;
+	key->dmabuf = dmabuf;
+	key->offset = fb->offsets[0];
+	key->view = *view;
+	return true;
+}
+
+static int ms912x_mirror_find_rect(const struct ms912x_usb_request *request,
+				   const struct drm_rect *rect)
+{
+	const struct drm_rect *r;
+	int i;
+
+	for (i = 0; i < request->nr_rects; i++) {
+		r = &request->rects[i];
+		if (rect->x1 >= r->x1 && rect->x2 <= r->x2 &&
+		    rect->y1 >= r->y1 && rect->y2 <= r->y2)
+			return i;
+	}
+	return -1;
+}
+
+/* Finds a published rect of another device that contains rect. The
+ * request is returned with a reference held while its pixels are copied,
+ * index is the rect in it.
+ */
+struct ms912x_usb_request *
+ms912x_mirror_get(struct ms912x_device *ms912x,
+		  const struct ms912x_mirror_key *key,
+		  const struct drm_rect *rect, int *index)
+{
+	unsigned long window = msecs_to_jiffies(mirror_window_ms);
+	struct ms912x_usb_request *request, *found = NULL;
+	struct ms912x_device *other;
+	int i;
+
+	mutex_lock(&ms912x_mirror_lock);
+	list_for_each_entry(other, &ms912x_mirror_list, mirror_node) {
+		if (other == ms912x)
+			continue;
+		for (i = 0; i < 2; i++) {
+			request = &other->requests[i];
+			if (!request->published ||
+			    time_after(jiffies, request->published_at + window) ||
+			    memcmp(&request->key, key, sizeof(*key)))
+				continue;
+			*index = ms912x_mirror_find_rect(request, rect);
+			if (*index < 0)
+				continue;
+			if (atomic_inc_return(&request->users) == 1)
+				reinit_completion(&request->done);
+			found = request;
+			goto out;
+		}
+	}
+out:
+	mutex_unlock(&ms912x_mirror_lock);
+	return found;
+}
+
+void ms912x_mirror_publish(struct ms912x_usb_request *request,
+			   const struct ms912x_mirror_key *key)
+{
+	struct ms912x_device *ms912x = request->ms912x;
+
+	mutex_lock(&ms912x_mirror_lock);
+	/* Only the newest payload of a device is offered */
+	ms912x->requests[0].published = false;
+	ms912x->requests[1].published = false;
+	request->key = *key;
+	request->published_at = jiffies;
+	request->published = true;
+	mutex_unlock(&ms912x_mirror_lock);
+}
+
+void ms912x_mirror_unpublish(struct ms912x_usb_request *request)
+{
+	mutex_lock(&ms912x_mirror_lock);
+	request->published = false;
+	mutex_unlock(&ms912x_mirror_lock);
+}
@@ -12,6 +12,7 @@ int ms912x_read_byte(struct ms912x_device *ms912x, u16 address)
 
 	request->type = 0xb5;
 	request->addr = cpu_to_be16(address);
+	mutex_lock(&ms912x->ctrl_lock);
 	usb_control_msg(usb_dev, usb_sndctrlpipe(usb_dev, 0),
 			HID_REQ_SET_REPORT,
 			USB_DIR_OUT | USB_TYPE_CLASS | USB_RECIP_INTERFACE,
@@ -20,6 +21,7 @@ int ms912x_read_byte(struct ms912x_device *ms912x, u16 address)
 			      HID_REQ_GET_REPORT,
 			      USB_DIR_IN | USB_TYPE_CLASS | USB_RECIP_INTERFACE,
 			      0x0300, 0, request, 8, USB_CTRL_GET_TIMEOUT);
+	mutex_unlock(&ms912x->ctrl_lock);
 
 	if (ret > 0)
 		ret = request->data[0];
@@ -41,10 +43,13 @@ static inline int ms912x_write_6_bytes(struct ms912x_device *ms912x,
 	request->addr = address;
 	memcpy(request->data, data, 6);
 
+	/* Must not land between the set and get report of a read */
+	mutex_lock(&ms912x->ctrl_lock);
 	ret = usb_control_msg(
 		usb_dev, usb_sndctrlpipe(usb_dev, 0), HID_REQ_SET_REPORT,
 		USB_DIR_OUT | USB_TYPE_CLASS | USB_RECIP_INTERFACE, 0x0300, 0,
 		request, 8, USB_CTRL_SET_TIMEOUT);
+	mutex_unlock(&ms912x->ctrl_lock);
 	kfree(request);
 	return ret;
 }
@@ -70,8 +75,13 @@ int ms912x_power_off(struct ms912x_device *ms912x)
 
 	return ret;
 }
+/* The resolution request sets the size of the frames that are sent
+ * (0xf204/0xf206) and the mode request the output timing (0xf382 and up).
+ * The device scales the frames when the two differ.
+ */
 int ms912x_set_resolution(struct ms912x_device *ms912x,
-			  const struct ms912x_mode *mode)
+			  const struct ms912x_mode *mode, int src_width,
+			  int src_height)
 {
 	int ret;
 	u8 data[6];
@@ -102,8 +112,8 @@ int ms912x_set_resolution(struct ms912x_device *ms912x,
 		return ret;
 
 	/* Write resolution */
-	resolution_request.width = cpu_to_be16(width);
-	resolution_request.height = cpu_to_be16(height);
+	resolution_request.width = cpu_to_be16(src_width);
+	resolution_request.height = cpu_to_be16(src_height);
 	resolution_request.pixel_format = cpu_to_be16(pixel_format);
 	ret = ms912x_write_6_bytes(ms912x, 0x01, &resolution_request);
 	if (ret < 0)
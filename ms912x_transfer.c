@@ -1,41 +1,157 @@
 
 #include <linux/dma-buf.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/module.h>
 #include <linux/vmalloc.h>
 
 #include <drm/drm_drv.h>
 #include <drm/drm_gem_framebuffer_helper.h>
+#include <drm/drm_print.h>
 
 #include "ms912x.h"
 
+static unsigned int convert_workers;
+module_param(convert_workers, uint, 0444);
+MODULE_PARM_DESC(convert_workers,
+		 "Conversion jobs running at once for all devices (0 = CPUs)");
+
+/* Shared by all devices so that many adapters do not oversubscribe the CPUs */
+static struct workqueue_struct *ms912x_convert_wq;
+
 static void ms912x_request_timeout(struct timer_list *t)
 {
 	struct ms912x_usb_request *request = from_timer(request, t, timer);
 	usb_sg_cancel(&request->sgr);
 }
 
+static unsigned long ms912x_request_timeout_ms(struct ms912x_device *ms912x,
+					       size_t len)
+{
+	unsigned int rate = READ_ONCE(ms912x->link_rate);
+
+	return MS912X_MIN_TIMEOUT_MS + MS912X_TIMEOUT_FACTOR * len / rate;
+}
+
+static void ms912x_update_link_rate(struct ms912x_device *ms912x, size_t len,
+				    s64 elapsed_us)
+{
+	struct usb_device *usbdev = interface_to_usbdev(ms912x->intf);
+	unsigned int nominal = usbdev->speed >= USB_SPEED_SUPER ?
+				       MS912X_USB3_RATE :
+				       MS912X_USB2_RATE;
+	unsigned int rate, sample;
+
+	/* Small transfers only measure the latency */
+	if (len < MS912X_MAX_TRANSFER_LENGTH || elapsed_us <= 0)
+		return;
+
+	sample = clamp_t(u64, div64_u64(len * 1000ULL, elapsed_us),
+			 nominal / 4, nominal * 4);
+	rate = READ_ONCE(ms912x->link_rate);
+	WRITE_ONCE(ms912x->link_rate, (rate * 7 + sample) / 8);
+}
+
+/* on_bus tells whether the transfer was submitted, failures to set it up
+ * only lose the frame.
+ */
+static void ms912x_request_error(struct ms912x_device *ms912x,
+				 unsigned int pipe, int status, bool on_bus)
+{
+	struct usb_device *usbdev = interface_to_usbdev(ms912x->intf);
+	int errors, idx;
+
+	/* Unplugged, nothing to recover */
+	if (status == -ENODEV || status == -ESHUTDOWN ||
+	    !drm_dev_enter(&ms912x->drm, &idx))
+		return;
+
+	if (!on_bus) {
+		drm_err_ratelimited(&ms912x->drm,
+				    "failed to set up transfer: %d\n", status);
+		goto resend;
+	}
+
+	drm_err_ratelimited(&ms912x->drm, "transfer failed: %d\n", status);
+
+	/* A failed transfer leaves the endpoint halted or the device in the
+	 * middle of a frame. Clear the halt first and only program the mode
+	 * again if that is not enough.
+	 */
+	errors = atomic_inc_return(&ms912x->transfer_errors);
+	if (usb_clear_halt(usbdev, pipe) || errors > 1)
+		set_bit(MS912X_RECOVER_MODE, &ms912x->recover_flags);
+
+resend:
+	/* The device buffers miss damage or are in an unknown state, send
+	 * a full frame.
+	 */
+	set_bit(MS912X_RECOVER_FULL, &ms912x->recover_flags);
+	mod_delayed_work(system_wq, &ms912x->update_work, 0);
+	drm_dev_exit(idx);
+}
+
 static void ms912x_request_work(struct work_struct *work)
 {
 	struct ms912x_usb_request *request =
 		container_of(work, struct ms912x_usb_request, work);
 	struct ms912x_device *ms912x = request->ms912x;
 	struct usb_device *usbdev = interface_to_usbdev(ms912x->intf);
+	unsigned int pipe = usb_sndbulkpipe(usbdev, 0x04);
 	struct usb_sg_request *sgr = &request->sgr;
 	struct sg_table *transfer_sgt = &request->transfer_sgt;
+	unsigned long timeout;
+	bool on_bus = false;
+	ktime_t start;
+	int status;
 
+	timeout = ms912x_request_timeout_ms(ms912x, request->transfer_len);
 	timer_setup(&request->timer, ms912x_request_timeout, 0);
-	usb_sg_init(sgr, usbdev, usb_sndbulkpipe(usbdev, 0x04), 0,
-		    transfer_sgt->sgl, transfer_sgt->nents,
-		    request->transfer_len, GFP_KERNEL);
-	mod_timer(&request->timer, jiffies + msecs_to_jiffies(5000));
-	usb_sg_wait(sgr);
-	del_timer_sync(&request->timer);
-	complete(&request->done);
+	start = ktime_get();
+	status = usb_sg_init(sgr, usbdev, pipe, 0, transfer_sgt->sgl,
+			     transfer_sgt->nents, request->transfer_len,
+			     GFP_KERNEL);
+	if (!status) {
+		on_bus = true;
+		mod_timer(&request->timer, jiffies + msecs_to_jiffies(timeout));
+		usb_sg_wait(sgr);
+		del_timer_sync(&request->timer);
+		status = sgr->status;
+	}
+
+	if (!status) {
+		atomic_set(&ms912x->transfer_errors, 0);
+		ms912x_update_link_rate(ms912x, request->transfer_len,
+					ktime_us_delta(ktime_get(), start));
+	} else {
+		ms912x_request_error(ms912x, pipe, status, on_bus);
+	}
+
+	ms912x_request_put(request);
+}
+
+void ms912x_request_put(struct ms912x_usb_request *request)
+{
+	if (atomic_dec_and_test(&request->users))
+		complete_all(&request->done);
+}
+
+void ms912x_cancel_request(struct ms912x_usb_request *request)
+{
+	/* A queued transfer still holds its references */
+	if (!cancel_work_sync(&request->work))
+		return;
+	ms912x_request_put(request);
 }
 
 void ms912x_free_request(struct ms912x_usb_request *request)
 {
 	if (!request->transfer_buffer)
 		return;
+	atomic_long_sub(request->alloc_len +
+				request->transfer_sgt.orig_nents *
+					sizeof(struct scatterlist),
+			&request->ms912x->mem_bytes);
 	sg_free_table(&request->transfer_sgt);
 	vfree(request->transfer_buffer);
 	request->transfer_buffer = NULL;
@@ -73,8 +189,14 @@ int ms912x_init_request(struct ms912x_device *ms912x,
 	request->alloc_len = len;
 	request->transfer_buffer = data;
 	request->ms912x = ms912x;
+	atomic_long_add(len + request->transfer_sgt.orig_nents *
+				      sizeof(struct scatterlist),
+			&ms912x->mem_bytes);
 
+	/* Idle until the first transfer */
 	init_completion(&request->done);
+	complete_all(&request->done);
+	atomic_set(&request->users, 0);
 	INIT_WORK(&request->work, ms912x_request_work);
 	return 0;
 err_vfree:
@@ -101,131 +223,460 @@ static inline unsigned int ms912x_rgb_to_v(unsigned int r, unsigned int g,
 	return v >> 16;
 }
 
-static int ms912x_xrgb_to_yuv422_line(u8 *transfer_buffer,
-				      struct iosys_map *xrgb_buffer,
-				      size_t offset, size_t width,
-				      u32 *temp_buffer)
+static inline __le32 ms912x_xrgb_to_uyvy(unsigned int pixel1,
+					  unsigned int pixel2)
 {
-	unsigned int i, dst_offset = 0;
-	unsigned int pixel1, pixel2;
 	unsigned int r1, g1, b1, r2, g2, b2;
 	unsigned int v, y1, u, y2;
-	iosys_map_memcpy_from(temp_buffer, xrgb_buffer, offset, width * 4);
+
+	r1 = (pixel1 >> 16) & 0xFF;
+	g1 = (pixel1 >> 8) & 0xFF;
+	b1 = pixel1 & 0xFF;
+	r2 = (pixel2 >> 16) & 0xFF;
+	g2 = (pixel2 >> 8) & 0xFF;
+	b2 = pixel2 & 0xFF;
+
+	y1 = ms912x_rgb_to_y(r1, g1, b1);
+	y2 = ms912x_rgb_to_y(r2, g2, b2);
+
+	v = (ms912x_rgb_to_v(r1, g1, b1) + ms912x_rgb_to_v(r2, g2, b2)) / 2;
+	u = (ms912x_rgb_to_u(r1, g1, b1) + ms912x_rgb_to_u(r2, g2, b2)) / 2;
+
+	return cpu_to_le32(u | y1 << 8 | v << 16 | y2 << 24);
+}
+
+static void ms912x_reverse_pixels(u32 *pixels, size_t width)
+{
+	size_t i;
+
+	for (i = 0; i < width / 2; i++)
+		swap(pixels[i], pixels[width - 1 - i]);
+}
+
+static void ms912x_xrgb_to_yuv422_line(u8 *transfer_buffer,
+				       const u32 *pixels, size_t width)
+{
+	__le32 *dst = (__le32 *)transfer_buffer;
+	unsigned int i, j, pixel1, pixel2, last1, last2;
+	__le32 uyvy = 0;
+
+	last1 = ~pixels[0] & 0xFFFFFF;
+	last2 = 0;
 	for (i = 0; i < width; i += 2) {
-		pixel1 = temp_buffer[i];
-		pixel2 = temp_buffer[i + 1];
+		pixel1 = pixels[i] & 0xFFFFFF;
+		pixel2 = pixels[i + 1] & 0xFFFFFF;
+
+		if (pixel1 != last1 || pixel2 != last2) {
+			uyvy = ms912x_xrgb_to_uyvy(pixel1, pixel2);
+			last1 = pixel1;
+			last2 = pixel2;
+		} else if (pixel1 == pixel2) {
+			/* A run of one color, fill it with the last result */
+			for (j = i + 2; j < width; j++)
+				if ((pixels[j] & 0xFFFFFF) != pixel1)
+					break;
+			j &= ~1;
+			memset32((u32 *)&dst[i / 2], (__force u32)uyvy,
+				 (j - i) / 2);
+			i = j - 2;
+			continue;
+		}
+		dst[i / 2] = uyvy;
+	}
+}
+
+static inline size_t ms912x_job_offset(struct ms912x_convert_job *job, int x,
+				       int y)
+{
+	return y * job->pitch + x * 4;
+}
+
+/* Display lines are framebuffer lines, possibly read backwards */
+static void ms912x_convert_lines(struct ms912x_convert_job *job)
+{
+	u32 *temp_buffer = job->temp_buffer;
+	void *dst = job->dst;
+	int i, x, y;
+
+	for (i = 0; i < job->lines; i++) {
+		x = job->sx + i * job->row_dx;
+		y = job->sy + i * job->row_dy;
+		if (job->col_dx < 0)
+			x -= job->width - 1;
+		iosys_map_memcpy_from(temp_buffer, &job->src,
+				      ms912x_job_offset(job, x, y),
+				      job->width * 4);
+		if (job->col_dx < 0)
+			ms912x_reverse_pixels(temp_buffer, job->width);
+		ms912x_xrgb_to_yuv422_line(dst, temp_buffer, job->width);
+		dst += job->width * 2;
+	}
+}
+
+/* Display lines are framebuffer columns. A block of display lines is read
+ * as short pieces of framebuffer lines into the tile buffer, so every
+ * cache line of the framebuffer is only read once.
+ */
+static void ms912x_convert_lines_rotated(struct ms912x_convert_job *job)
+{
+	u32 *temp_buffer = job->temp_buffer;
+	u32 *tile = job->tile_buffer;
+	void *dst = job->dst;
+	int i, j, c, n, x, y;
+
+	for (i = 0; i < job->lines; i += n) {
+		n = min(job->lines - i, MS912X_ROTATE_BLOCK);
+		x = job->sx + i * job->row_dx;
+		if (job->row_dx < 0)
+			x -= n - 1;
+		for (c = 0; c < job->width; c++) {
+			y = job->sy + c * job->col_dy;
+			iosys_map_memcpy_from(&tile[c * n], &job->src,
+					      ms912x_job_offset(job, x, y),
+					      n * 4);
+		}
+		for (j = 0; j < n; j++) {
+			x = job->row_dx > 0 ? j : n - 1 - j;
+			for (c = 0; c < job->width; c++)
+				temp_buffer[c] = tile[c * n + x];
+			ms912x_xrgb_to_yuv422_line(dst, temp_buffer,
+						   job->width);
+			dst += job->width * 2;
+		}
+	}
+}
 
-		r1 = (pixel1 >> 16) & 0xFF;
-		g1 = (pixel1 >> 8) & 0xFF;
-		b1 = pixel1 & 0xFF;
-		r2 = (pixel2 >> 16) & 0xFF;
-		g2 = (pixel2 >> 8) & 0xFF;
-		b2 = pixel2 & 0xFF;
+static void ms912x_convert_job(struct ms912x_convert_job *job)
+{
+	if (job->col_dy)
+		ms912x_convert_lines_rotated(job);
+	else
+		ms912x_convert_lines(job);
+}
+
+static void ms912x_convert_work(struct work_struct *work)
+{
+	struct ms912x_convert_job *job =
+		container_of(work, struct ms912x_convert_job, work);
+	struct ms912x_device *ms912x = job->ms912x;
 
-		y1 = ms912x_rgb_to_y(r1, g1, b1);
-		y2 = ms912x_rgb_to_y(r2, g2, b2);
+	ms912x_convert_job(job);
+	if (atomic_dec_and_test(&ms912x->convert_pending))
+		complete(&ms912x->convert_done);
+}
 
-		v = (ms912x_rgb_to_v(r1, g1, b1) +
-		     ms912x_rgb_to_v(r2, g2, b2)) /
-		    2;
-		u = (ms912x_rgb_to_u(r1, g1, b1) +
-		     ms912x_rgb_to_u(r2, g2, b2)) /
-		    2;
+void ms912x_free_convert_jobs(struct ms912x_device *ms912x)
+{
+	struct ms912x_convert_job *job;
+	int i;
+
+	for (i = 0; i < MS912X_CONVERT_JOBS; i++) {
+		job = &ms912x->convert_jobs[i];
+		if (job->temp_buffer) {
+			kfree(job->temp_buffer);
+			job->temp_buffer = NULL;
+			atomic_long_sub(MS912X_MAX_LINE_BYTES,
+					&ms912x->mem_bytes);
+		}
+		if (job->tile_buffer) {
+			kvfree(job->tile_buffer);
+			job->tile_buffer = NULL;
+			atomic_long_sub(MS912X_TILE_BUFFER_BYTES,
+					&ms912x->mem_bytes);
+		}
+	}
+}
 
-		transfer_buffer[dst_offset++] = u;
-		transfer_buffer[dst_offset++] = y1;
-		transfer_buffer[dst_offset++] = v;
-		transfer_buffer[dst_offset++] = y2;
+int ms912x_init_convert_jobs(struct ms912x_device *ms912x)
+{
+	struct ms912x_convert_job *job;
+	int i;
+
+	init_completion(&ms912x->convert_done);
+	for (i = 0; i < MS912X_CONVERT_JOBS; i++) {
+		job = &ms912x->convert_jobs[i];
+		job->ms912x = ms912x;
+		INIT_WORK(&job->work, ms912x_convert_work);
+		job->temp_buffer = kmalloc(MS912X_MAX_LINE_BYTES, GFP_KERNEL);
+		if (!job->temp_buffer)
+			goto err_free;
+		atomic_long_add(MS912X_MAX_LINE_BYTES, &ms912x->mem_bytes);
+		job->tile_buffer =
+			kvmalloc(MS912X_TILE_BUFFER_BYTES, GFP_KERNEL);
+		if (!job->tile_buffer)
+			goto err_free;
+		atomic_long_add(MS912X_TILE_BUFFER_BYTES, &ms912x->mem_bytes);
 	}
-	return offset;
+	return 0;
+err_free:
+	ms912x_free_convert_jobs(ms912x);
+	return -ENOMEM;
+}
+
+int ms912x_convert_pool_init(void)
+{
+	ms912x_convert_wq = alloc_workqueue("ms912x_convert",
+					    WQ_UNBOUND | WQ_SYSFS,
+					    convert_workers ?: num_online_cpus());
+	if (!ms912x_convert_wq)
+		return -ENOMEM;
+	return 0;
+}
+
+void ms912x_convert_pool_fini(void)
+{
+	destroy_workqueue(ms912x_convert_wq);
 }
 
 static const u8 ms912x_end_of_buffer[8] = { 0xff, 0xc0, 0x00, 0x00,
 					    0x00, 0x00, 0x00, 0x00 };
 
-static int ms912x_fb_xrgb8888_to_yuv422(void *dst, const struct iosys_map *src,
-					struct drm_framebuffer *fb,
-					struct drm_rect *rect)
+/* Framebuffer pixel shown at a display pixel */
+static void ms912x_display_to_fb(const struct ms912x_view *view, int x, int y,
+				 int *fb_x, int *fb_y)
+{
+	struct drm_rect r;
+
+	drm_rect_init(&r, x, y, 1, 1);
+	drm_rect_rotate_inv(&r, drm_rect_width(&view->src),
+			    drm_rect_height(&view->src), view->rotation);
+	*fb_x = view->src.x1 + r.x1;
+	*fb_y = view->src.y1 + r.y1;
+}
+
+static void ms912x_fb_write_header(void *dst, const struct drm_rect *rect)
 {
 	struct ms912x_frame_update_header *header =
 		(struct ms912x_frame_update_header *)dst;
-	struct iosys_map fb_map;
-	int i, x, y1, y2, width;
-	void *temp_buffer;
+
+	header->header = cpu_to_be16(0xff00);
+	header->x = rect->x1 / 16;
+	header->y = cpu_to_be16(rect->y1);
+	header->width = drm_rect_width(rect) / 16;
+	header->height = cpu_to_be16(drm_rect_height(rect));
+}
+
+/* Converts the pixels of rect, dst points behind the header */
+static void ms912x_fb_xrgb8888_to_yuv422(struct ms912x_device *ms912x,
+					 void *dst, const struct iosys_map *src,
+					 const struct ms912x_view *view,
+					 const struct drm_rect *rect)
+{
+	struct ms912x_convert_job *job;
+	int i, x, y1, y2, width, lines, jobs, band;
+	int sx, sy, col_x, col_y, row_x, row_y;
 
 	y1 = rect->y1;
-	y2 = min((unsigned int)rect->y2, fb->height);
+	y2 = rect->y2;
 	x = rect->x1;
 	width = drm_rect_width(rect);
 
-	temp_buffer = kmalloc(width * 4, GFP_KERNEL);
-	if (!temp_buffer)
-		return -ENOMEM;
+	/* Rotation and reflection are applied while reading, as steps in
+	 * the framebuffer between display pixels and between display lines.
+	 */
+	ms912x_display_to_fb(view, x, y1, &sx, &sy);
+	ms912x_display_to_fb(view, x + 1, y1, &col_x, &col_y);
+	ms912x_display_to_fb(view, x, y1 + 1, &row_x, &row_y);
 
-	header->header = cpu_to_be16(0xff00);
-	header->x = x / 16;
-	header->y = cpu_to_be16(y1);
-	header->width = width / 16;
-	header->height = cpu_to_be16(drm_rect_height(rect));
-	dst += sizeof(*header);
+	/* Split the rect into bands, the first band is converted by the
+	 * committing thread while the others run on the shared pool.
+	 */
+	lines = y2 - y1;
+	jobs = clamp(lines / MS912X_CONVERT_MIN_LINES, 1, MS912X_CONVERT_JOBS);
+	band = DIV_ROUND_UP(lines, jobs);
+
+	reinit_completion(&ms912x->convert_done);
+	atomic_set(&ms912x->convert_pending, jobs - 1);
+	for (i = 0; i < jobs; i++) {
+		job = &ms912x->convert_jobs[i];
+		job->src = *src;
+		job->pitch = view->pitch;
+		job->dst = dst;
+		job->width = width;
+		job->lines = min(band, y2 - y1);
+		job->col_dx = col_x - sx;
+		job->col_dy = col_y - sy;
+		job->row_dx = row_x - sx;
+		job->row_dy = row_y - sy;
+		job->sx = sx + (y1 - rect->y1) * job->row_dx;
+		job->sy = sy + (y1 - rect->y1) * job->row_dy;
+		y1 += job->lines;
+		dst += job->lines * width * 2;
+		if (i)
+			queue_work(ms912x_convert_wq, &job->work);
+	}
+	ms912x_convert_job(&ms912x->convert_jobs[0]);
+	if (jobs > 1)
+		wait_for_completion(&ms912x->convert_done);
+}
 
-	fb_map = IOSYS_MAP_INIT_OFFSET(src, y1 * fb->pitches[0]);
-	for (i = y1; i < y2; i++) {
-		ms912x_xrgb_to_yuv422_line(dst, &fb_map, x * 4, width, temp_buffer);
-		iosys_map_incr(&fb_map, fb->pitches[0]);
-		dst += width * 2;
+/* Copies the pixels of rect from a rect of another device containing it */
+static void ms912x_fb_copy_rect(void *dst,
+			       const struct ms912x_usb_request *shared,
+			       int index, const struct drm_rect *rect)
+{
+	const struct drm_rect *r = &shared->rects[index];
+	size_t line = drm_rect_width(rect) * 2;
+	size_t pitch = drm_rect_width(r) * 2;
+	const void *src = shared->transfer_buffer + shared->offsets[index] +
+			  (rect->y1 - r->y1) * pitch + (rect->x1 - r->x1) * 2;
+	int y;
+
+	if (line == pitch) {
+		memcpy(dst, src, line * drm_rect_height(rect));
+		return;
+	}
+	for (y = rect->y1; y < rect->y2; y++) {
+		memcpy(dst, src, line);
+		dst += line;
+		src += pitch;
 	}
+}
 
-	kfree(temp_buffer);
-	memcpy(dst, ms912x_end_of_buffer, sizeof(ms912x_end_of_buffer));
-	return 0;
+/* Fills the transfer, each rect is sent as a header followed by its
+ * pixels and the transfer ends with a single terminator. Pixels are copied
+ * from mirrored devices where they have been converted already.
+ */
+static size_t ms912x_fb_convert_rects(struct ms912x_device *ms912x,
+				      struct ms912x_usb_request *request,
+				      const struct iosys_map *src,
+				      const struct ms912x_view *view,
+				      const struct ms912x_mirror_key *key,
+				      const struct drm_rect *rects,
+				      int nr_rects)
+{
+	void *dst = request->transfer_buffer;
+	struct ms912x_usb_request *shared;
+	size_t len = 0;
+	int i, index;
+
+	for (i = 0; i < nr_rects; i++) {
+		ms912x_fb_write_header(dst + len, &rects[i]);
+		len += sizeof(struct ms912x_frame_update_header);
+
+		request->rects[i] = rects[i];
+		request->offsets[i] = len;
+
+		shared = key ? ms912x_mirror_get(ms912x, key, &rects[i],
+						 &index) :
+			       NULL;
+		if (shared) {
+			ms912x_fb_copy_rect(dst + len, shared, index, &rects[i]);
+			ms912x_request_put(shared);
+		} else {
+			ms912x_fb_xrgb8888_to_yuv422(ms912x, dst + len, src,
+						     view, &rects[i]);
+		}
+		len += drm_rect_width(&rects[i]) * drm_rect_height(&rects[i]) *
+		       2;
+	}
+	request->nr_rects = nr_rects;
+
+	memcpy(dst + len, ms912x_end_of_buffer, sizeof(ms912x_end_of_buffer));
+	return len + sizeof(ms912x_end_of_buffer);
+}
+
+void ms912x_get_view(const struct drm_plane_state *state,
+		     struct ms912x_view *view)
+{
+	view->src.x1 = state->src.x1 >> 16;
+	view->src.y1 = state->src.y1 >> 16;
+	view->src.x2 = state->src.x2 >> 16;
+	view->src.y2 = state->src.y2 >> 16;
+	view->rotation = state->rotation;
+	view->pitch = state->fb->pitches[0];
+	view->width = drm_rect_width(&state->dst);
+	view->height = drm_rect_height(&state->dst);
 }
 
-int ms912x_fb_send_rect(struct drm_framebuffer *fb, const struct iosys_map *map,
-			struct drm_rect *rect)
+void ms912x_fb_to_display(const struct ms912x_view *view,
+			  struct drm_rect *rect)
+{
+	drm_rect_translate(rect, -view->src.x1, -view->src.y1);
+	drm_rect_rotate(rect, drm_rect_width(&view->src),
+			drm_rect_height(&view->src), view->rotation);
+}
+
+/* Sends rects of the display, which shows the plane as described by
+ * the plane state.
+ */
+int ms912x_fb_send_rects(const struct drm_plane_state *state,
+			 const struct iosys_map *map,
+			 const struct drm_rect *damage, int nr_rects)
 {
 	int ret = 0, idx;
+	struct drm_framebuffer *fb = state->fb;
 	struct ms912x_device *ms912x = to_ms912x(fb->dev);
 	struct drm_device *drm = &ms912x->drm;
 	struct ms912x_usb_request *prev_request, *current_request;
-	int x, width;
+	struct drm_rect rects[MS912X_MAX_RECTS];
+	struct ms912x_mirror_key key;
+	struct ms912x_view view;
+	bool mirrored;
+	int i, n, x, width;
+	size_t len;
+
+	ms912x_get_view(state, &view);
 
 	/* Seems like hardware can only update framebuffer 
 	 * in multiples of 16 horizontally
 	 */
-	x = ALIGN_DOWN(rect->x1, 16);
-	/* Resolutions that are not a multiple of 16 like 1366*768 
-	 * need to be aligned
-	 */
-	width = min(ALIGN(rect->x2, 16), ALIGN_DOWN((int)fb->width, 16)) - x;
-	rect->x1 = x;
-	rect->x2 = x + width;
+	for (i = 0, n = 0; i < min(nr_rects, MS912X_MAX_RECTS); i++) {
+		x = ALIGN_DOWN(damage[i].x1, 16);
+		/* Resolutions that are not a multiple of 16 like 1366*768 
+		 * need to be aligned
+		 */
+		width = min(ALIGN(damage[i].x2, 16),
+			    ALIGN_DOWN(view.width, 16)) - x;
+		rects[n].x1 = x;
+		rects[n].x2 = x + width;
+		rects[n].y1 = damage[i].y1;
+		rects[n].y2 = min(damage[i].y2, view.height);
+		if (drm_rect_visible(&rects[n]))
+			n++;
+	}
+	nr_rects = n;
+	if (!nr_rects)
+		return 0;
+
 	current_request = &ms912x->requests[ms912x->current_request];
 	prev_request = &ms912x->requests[1 - ms912x->current_request];
 
-	drm_dev_enter(drm, &idx);
+	if (!drm_dev_enter(drm, &idx))
+		return -ENODEV;
+
+	/* Mirrored devices may still be copying from this buffer */
+	ms912x_mirror_unpublish(current_request);
+	if (!wait_for_completion_timeout(&current_request->done,
+					 msecs_to_jiffies(10))) {
+		ret = -ETIMEDOUT;
+		goto dev_exit;
+	}
+
+	mirrored = ms912x_mirror_make_key(fb, &view, &key);
 
 	ret = drm_gem_fb_begin_cpu_access(fb, DMA_FROM_DEVICE);
 	if (ret < 0)
 		goto dev_exit;
 
-	ret = ms912x_fb_xrgb8888_to_yuv422(current_request->transfer_buffer,
-					   map, fb, rect);
-	
+	len = ms912x_fb_convert_rects(ms912x, current_request, map, &view,
+				      mirrored ? &key : NULL, rects, nr_rects);
+
 	drm_gem_fb_end_cpu_access(fb, DMA_FROM_DEVICE);
-	if (ret < 0)
-		goto dev_exit;
 
 	/* Sending frames too fast, drop it */
 	if (!wait_for_completion_timeout(&prev_request->done,
 					 msecs_to_jiffies(10))) {
-
 		ret = -ETIMEDOUT;
 		goto dev_exit;
 	}
 
-	current_request->transfer_len = width * 2 * drm_rect_height(rect) + 16;
-	queue_work(system_long_wq, &current_request->work);
+	current_request->transfer_len = len;
+	reinit_completion(&current_request->done);
+	atomic_set(&current_request->users, 1);
+	if (mirrored)
+		ms912x_mirror_publish(current_request, &key);
+	queue_work(ms912x->submit_wq, &current_request->work);
 	ms912x->current_request = 1 - ms912x->current_request;
 dev_exit:
 	drm_dev_exit(idx);